@@ -5,6 +5,12 @@
 #include <vector>
 #include <iostream>
 #include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <cstdio>
+#include <unordered_map>
+#include <filesystem>
 
 /**
  * Copyright 2023 Andrew Toone / Feersum Technology Ltd.
@@ -27,8 +33,33 @@ enum Action {APPEND, INSERT, WRITE, OFFSET};
 
 enum Mode {BYTES, WORDS, LONGS};
 
+/**
+ * An output requested by the script with 'output' or 'split'. Ranges are resolved against the
+ * finished blob once the whole script has run, so every output comes from the same assembly.
+ */
+struct OutputSpec {
+    std::string filename;           // Filename, or printf-style pattern for splits
+    long fromByte   = 0;
+    long toByte     = -1;
+    long countBytes = -1;
+    long splitSize  = -1;           // Chunk size for 'split', -1 for a single output
+    int lineNumber  = 0;            // Script line, for error reporting
+};
+
+/**
+ * A resolved region of the blob to be written to a file
+ */
+struct OutputRegion {
+    std::string filename;
+    long fromByte;
+    long countBytes;
+    int lineNumber;                 // Script line, or 0 for the command line output file
+};
+
 const std::string digits = "0123456789ABCDEF";
 
+const unsigned int maxSplitWidth = 32;
+
 std::vector<std::string> read_file_as_strings(const std::string& filename) {
     std::vector<std::string> lines;
     std::ifstream file(filename);
@@ -342,7 +373,222 @@ std::vector<std::byte> read_file(std::string filename, long &fromByte, long toBy
     return fileData;
 }
 
-void process_tokens(std::vector<std::string> tokens, std::vector<std::byte> &data, long &previousEnd, Action &previousAction) {
+std::string unquote(const std::string& str) {
+    if( str.length() >= 2 && str.front() == '"' && str.back() == '"' ) {
+        return str.substr(1, str.length()-2);
+    }
+    return str;
+}
+
+/**
+ * Expand a split filename pattern for the given chunk number. The pattern must contain exactly one
+ * '%d' conversion, optionally with a zero flag and width (e.g. '%03d'). Use '%%' for a literal '%'.
+ */
+std::string format_split_name(const std::string& pattern, long number) {
+    std::string result;
+    int conversions = 0;
+
+    for( unsigned int i=0; i<pattern.length(); i++ ) {
+        if( pattern[i] != '%' ) {
+            result += pattern[i];
+            continue;
+        }
+        if( ++i < pattern.length() && pattern[i] == '%' ) {
+            result += '%';
+            continue;
+        }
+        char fill = ' ';
+        if( i < pattern.length() && pattern[i] == '0' ) {
+            fill = '0';
+            i++;
+        }
+        unsigned int width = 0;
+        while( i < pattern.length() && isdigit(pattern[i]) ) {
+            width = width * 10 + (pattern[i] - '0');
+            if( width > maxSplitWidth ) {
+                throw std::invalid_argument("Invalid split pattern '"+pattern+"' - width cannot be more than "+std::to_string(maxSplitWidth));
+            }
+            i++;
+        }
+        if( i >= pattern.length() || pattern[i] != 'd' ) {
+            throw std::invalid_argument("Invalid split pattern '"+pattern+"' - only %d, with optional width, is supported");
+        }
+        std::string value = std::to_string(number);
+        if( value.length() < width ) {
+            value.insert(0, width - value.length(), fill);
+        }
+        result += value;
+        conversions++;
+    }
+    if( conversions != 1 ) {
+        throw std::invalid_argument("Split pattern '"+pattern+"' must contain exactly one %d");
+    }
+    return result;
+}
+
+/**
+ * Parse an 'output <filename>' or 'split <size> <pattern>' line, followed by optional 'from', 'to' and 'bytes'
+ */
+OutputSpec parse_output(std::vector<std::string> tokens, bool isSplit, int lineNumber) {
+    OutputSpec spec;
+    spec.lineNumber = lineNumber;
+
+    unsigned int index = 1;
+
+    if( isSplit ) {
+        spec.splitSize = parse_number(tokens, index++);
+        if( spec.splitSize <= 0 ) {
+            throw std::invalid_argument("Split size must be at least 1");
+        }
+    }
+    if( index >= tokens.size() ) {
+        throw std::invalid_argument(isSplit ? "Split requires a filename pattern" : "Output requires a filename parameter");
+    }
+    spec.filename = unquote(tokens[index++]);
+    if( spec.filename.length() == 0 ) {
+        throw std::invalid_argument("Output filename cannot be empty");
+    }
+    if( isSplit ) {
+        format_split_name(spec.filename, 0);      // Check the pattern now, so errors report the script line
+    }
+
+    while( index < tokens.size() ) {
+        if( equalsIgnoreCase(tokens[index], "from") ) {
+            spec.fromByte = parse_number(tokens, ++index);
+        } else if( equalsIgnoreCase(tokens[index], "to") ) {
+            spec.toByte = parse_number(tokens, ++index);
+        } else if( equalsIgnoreCase(tokens[index], "bytes") ) {
+            spec.countBytes = parse_number(tokens, ++index);
+        } else {
+            throw std::invalid_argument("Unexpected token: "+tokens[index]);
+        }
+        if( parse_number(tokens, index) < 0 ) {
+            throw std::invalid_argument("Value for "+tokens[index-1]+" must be positive or zero");
+        }
+        if( spec.toByte == 0 ) {
+            throw std::invalid_argument("Value for to must be greater than zero");
+        }
+        index++;
+    }
+    return spec;
+}
+
+std::string describe_output(const OutputRegion& region) {
+    if( region.lineNumber == 0 ) {
+        return "command line output file";
+    }
+    return "output on line "+std::to_string(region.lineNumber);
+}
+
+/**
+ * Resolve the requested outputs against the finished blob. The command line output file, if given,
+ * is included as a region covering the whole blob.
+ */
+std::vector<OutputRegion> resolve_outputs(std::vector<OutputSpec> outputs, long dataSize, std::string filename) {
+    std::vector<OutputRegion> regions;
+
+    if( filename.length() > 0 ) {
+        regions.push_back({filename, 0, dataSize, 0});
+    }
+
+    for( OutputSpec& spec: outputs ) {
+        try {
+            check_offsets(spec.fromByte, spec.toByte, spec.countBytes, dataSize, -1, -1);
+            if( spec.countBytes == 0 ) {
+                throw std::invalid_argument("Output region starting at byte "+std::to_string(spec.fromByte)+" is empty - data is "+std::to_string(dataSize)+" bytes");
+            }
+        }
+        catch(...) {
+            std::cerr << "Error on line " << spec.lineNumber << std::endl;
+            throw;
+        }
+
+        if( spec.splitSize < 0 ) {
+            regions.push_back({spec.filename, spec.fromByte, spec.countBytes, spec.lineNumber});
+            continue;
+        }
+        long number = 0;
+        for( long offset = 0; offset < spec.countBytes; offset += spec.splitSize ) {
+            long count = std::min(spec.splitSize, spec.countBytes - offset);
+            regions.push_back({format_split_name(spec.filename, number++), spec.fromByte + offset, count, spec.lineNumber});
+        }
+    }
+
+    std::unordered_map<std::string, size_t> seen;
+    for( size_t i=0; i<regions.size(); i++ ) {
+        std::string key = std::filesystem::path(regions[i].filename).lexically_normal().string();
+        auto [existing, inserted] = seen.emplace(key, i);
+        if( !inserted ) {
+            const OutputRegion& first = regions[existing->second];
+            throw std::invalid_argument("Output file "+regions[i].filename+" is written by both the "+describe_output(first)+" and the "+describe_output(regions[i]));
+        }
+    }
+    return regions;
+}
+
+/**
+ * Write each region of the blob to its file. Files are written in parallel by a small pool of
+ * threads, all reading from the single in-memory blob. Results are reported in region order once
+ * every thread has finished. A regular file that was opened but not completely written is removed.
+ *
+ * Returns false if any file could not be written.
+ */
+bool write_outputs(const std::vector<std::byte> &data, const std::vector<OutputRegion> &regions) {
+    enum class Result {Written, OpenFailed, WriteFailed};
+
+    std::atomic<unsigned int> next(0);
+    std::vector<Result> results(regions.size(), Result::OpenFailed);
+
+    auto worker = [&]() {
+        for( unsigned int i = next++; i < regions.size(); i = next++ ) {
+            const OutputRegion& region = regions[i];
+
+            std::ofstream outfile(region.filename, std::ios::out | std::ios::binary);
+            if( !outfile.is_open() ) {
+                results[i] = Result::OpenFailed;
+                continue;
+            }
+            outfile.write((const char*)data.data() + region.fromByte, region.countBytes);
+            outfile.close();
+
+            results[i] = outfile.fail() ? Result::WriteFailed : Result::Written;
+        }
+    };
+
+    unsigned int threadCount = std::max(1u, std::thread::hardware_concurrency());
+    threadCount = std::min(threadCount, (unsigned int)regions.size());
+
+    std::vector<std::thread> threads;
+    for( unsigned int i=0; i<threadCount; i++ ) {
+        threads.emplace_back(worker);
+    }
+    for( std::thread& thread: threads ) {
+        thread.join();
+    }
+
+    bool success = true;
+    for( unsigned int i=0; i<regions.size(); i++ ) {
+        switch( results[i] ) {
+            case Result::Written:
+                std::cout << "Wrote " << regions[i].countBytes << " bytes to " << regions[i].filename << std::endl;
+                break;
+            case Result::OpenFailed:
+                std::cerr << "Error: Unable to open file " << regions[i].filename << " (" << describe_output(regions[i]) << ")" << std::endl;
+                success = false;
+                break;
+            case Result::WriteFailed:
+                if( std::filesystem::is_regular_file(regions[i].filename) ) {
+                    std::remove(regions[i].filename.c_str());
+                }
+                std::cerr << "Error: Unable to write file " << regions[i].filename << " (" << describe_output(regions[i]) << ")" << std::endl;
+                success = false;
+                break;
+        }
+    }
+    return success;
+}
+
+void process_tokens(std::vector<std::string> tokens, std::vector<std::byte> &data, long &previousEnd, Action &previousAction, std::vector<OutputSpec> &outputs, int lineNumber) {
     // Guaranteed to have at least one token
 
     Action action;
@@ -389,6 +635,14 @@ void process_tokens(std::vector<std::string> tokens, std::vector<std::byte> &dat
         check_no_more_tokens(tokens, 2);
         return;
     }
+    else if( equalsIgnoreCase(tokens[index], "output") ) {
+        outputs.push_back(parse_output(tokens, false, lineNumber));
+        return;
+    }
+    else if( equalsIgnoreCase(tokens[index], "split") ) {
+        outputs.push_back(parse_output(tokens, true, lineNumber));
+        return;
+    }
     else {
         std::cout << "Got Unknown action '" << tokens[index] << "'" << std::endl;
 
@@ -596,11 +850,12 @@ void process_tokens(std::vector<std::string> tokens, std::vector<std::byte> &dat
     }
 }
 
-void process_script(std::vector<std::string> script, std::string filename) {
+bool process_script(std::vector<std::string> script, std::string filename) {
 
     int lineNumber = 1;
 
     std::vector<std::byte> data;
+    std::vector<OutputSpec> outputs;
 
     long previousEnd = -1;
     Action previousAction = Action::APPEND;
@@ -610,7 +865,7 @@ void process_script(std::vector<std::string> script, std::string filename) {
             std::vector<std::string> tokens = tokenize_string(line);
 
             if( tokens.size() > 0 ) {
-                process_tokens(tokens, data, previousEnd, previousAction);
+                process_tokens(tokens, data, previousEnd, previousAction, outputs, lineNumber);
             }
             lineNumber++;
         }
@@ -620,20 +875,22 @@ void process_script(std::vector<std::string> script, std::string filename) {
         throw;
     }
 
-    if( data.size() > 0 ) {
-        std::ofstream outfile(filename, std::ios::out | std::ios::binary); 
-        outfile.write((const char*)data.data(), data.size());
-        std::cout << "Wrote " << data.size() << " bytes to " << filename << std::endl;
+    if( filename.length() == 0 && outputs.size() == 0 ) {
+        throw std::invalid_argument("No output file given, and script has no 'output' or 'split' commands");
     }
-    else {
-        std::cout << "No data created, file not written" << std::endl;
+
+    if( data.size() > 0 ) {
+        std::vector<OutputRegion> regions = resolve_outputs(outputs, data.size(), filename);
+        return write_outputs(data, regions);
     }
+    std::cout << "No data created, file not written" << std::endl;
+    return true;
 }
 
 int main(int argc, char* argv[]) {
-    if( argc != 3 ) {
+    if( argc != 2 && argc != 3 ) {
         std::cout << "Globber v1.0 - build binary data files with scripts" << std::endl;
-        std::cout << "  Usage: globber script-file output-file" << std::endl;
+        std::cout << "  Usage: globber script-file [output-file]" << std::endl;
         std::cout << "Script reference: " << std::endl;
         std::cout << "  Each line of the script file is of the form  <command> <arguments> # comment"<< std::endl;
         std::cout << "  Commands:" << std::endl;
@@ -641,6 +898,8 @@ int main(int argc, char* argv[]) {
         std::cout << "     insert         - insert data" << std::endl;
         std::cout << "     write          - overwrite data" << std::endl;
         std::cout << "     offset <value> - set offset for insert/overwrite" << std::endl;
+        std::cout << "     output <filename> [from/to/bytes]       - also write a region of the result to a file" << std::endl;
+        std::cout << "     split <size> <pattern> [from/to/bytes]  - write the result in chunks to files named by pattern, e.g. \"part_%03d.bin\"" << std::endl;
         std::cout << "  Arguments:" << std::endl;
         std::cout << "     file <filename>                   - read data from file" << std::endl;
         std::cout << "     data <value> [,<value>...]        - read data from list of values" << std::endl;
@@ -665,6 +924,11 @@ int main(int argc, char* argv[]) {
     }
 
     std::vector<std::string> script = read_file_as_strings(argv[1]);
-    process_script(script, argv[2]);
-    return 0;
+    try {
+        return process_script(script, argc == 3 ? argv[2] : "") ? 0 : 1;
+    }
+    catch(const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
 }
\ No newline at end of file